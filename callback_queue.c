@@ -0,0 +1,35 @@
+#include "callback_queue.h"
+
+void callback_queue_init(struct CallbackQueue* queue)
+{
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+}
+
+int callback_queue_push(struct CallbackQueue* queue, const struct CallbackTrigger* trigger)
+{
+	unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+	if (tail - head >= CALLBACK_QUEUE_SIZE)
+		return 0;
+
+	queue->entries[tail & (CALLBACK_QUEUE_SIZE - 1)] = *trigger;
+	/* Publish the entry only after it has been written */
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+int callback_queue_pop(struct CallbackQueue* queue, struct CallbackTrigger* trigger)
+{
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+	if (head == tail)
+		return 0;
+
+	*trigger = queue->entries[head & (CALLBACK_QUEUE_SIZE - 1)];
+	/* Hand the slot back to the producer only after it has been read */
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return 1;
+}
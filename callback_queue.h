@@ -0,0 +1,38 @@
+#ifndef CALLBACK_QUEUE_H
+#define CALLBACK_QUEUE_H
+#include <inttypes.h>
+#include <stdatomic.h>
+
+/* Must be a power of two */
+#define CALLBACK_QUEUE_SIZE 256
+
+/**
+ * An XMIDI callback trigger (controller 0x77) together with the tick it
+ * is due at and the time at which it was actually handed over.
+ */
+struct CallbackTrigger {
+	uint32_t time;      ///< Tick at which the trigger is placed in the sequence.
+	uint8_t value;      ///< The controller value, i.e. the cue number.
+	uint32_t due_ms;    ///< Playback time in ms at which the trigger should fire.
+	uint32_t posted_ms; ///< Playback time in ms at which it was queued.
+};
+
+/**
+ * Lock-free single-producer/single-consumer ring buffer. One thread (e.g.
+ * the audio thread) may push while another pops, without either of them
+ * ever blocking. Pushing to a full queue fails instead of waiting.
+ */
+struct CallbackQueue {
+	struct CallbackTrigger entries[CALLBACK_QUEUE_SIZE];
+	atomic_uint head; ///< Next slot to pop, only written by the consumer
+	atomic_uint tail; ///< Next slot to push, only written by the producer
+};
+
+void callback_queue_init(struct CallbackQueue* queue);
+
+/* Returns 0 if the queue is full */
+int callback_queue_push(struct CallbackQueue* queue, const struct CallbackTrigger* trigger);
+
+/* Returns 0 if the queue is empty */
+int callback_queue_pop(struct CallbackQueue* queue, struct CallbackTrigger* trigger);
+#endif
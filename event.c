@@ -1,10 +1,16 @@
 #include "event.h"
+#include "hooks.h"
+#include "stats.h"
 
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 
-#define warning(...) fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n");
+#define warning(...) xmidi_warning(__VA_ARGS__)
+#ifdef XMIDI_DEBUG
+#define debug(...) printf(__VA_ARGS__)
+#else
+#define debug(...) do { } while (0)
+#endif
 #define ARRAYSIZE(x) ((int)(sizeof(x) / sizeof(x[0])))
 
 // This is a special XMIDI variable length quantity
@@ -40,82 +46,76 @@ static uint32_t readVLQ(uint8_t** data) {
 	return value;
 }
 
-struct CachedEvent {
-	struct EventInfo* eventInfo;
-	uint32_t time;
-	struct CachedEvent* next;
-};
-struct CachedEvent* cached_events = NULL;
+/* Note Offs waiting to be injected, sorted with the latest first so that
+ * the next one due is popped off the end */
+static struct PendingNoteOff cached_events[MAX_CACHED_EVENTS];
+static int num_cached_events = 0;
 
-static void save_event(struct EventInfo* info, uint32_t current_time)
+int push_note_off(struct PendingNoteOff* pending, int* count, int max,
+                  struct EventInfo* info, uint32_t time)
 {
-	uint32_t delta = info->length;
-	struct CachedEvent *prev, *next, *temp;
+	int i;
 
-	temp = malloc(sizeof(struct CachedEvent));
-	temp->eventInfo = info;
-	temp->time = current_time + delta;
-	temp->next = NULL;
+	if (*count == max)
+		return 0;
 
-	printf("Saving event to be stopped at %2X\n", temp->time);
+	/* Find the proper time slot */
+	for (i = *count; i > 0 && pending[i - 1].time < time; i--)
+		pending[i] = pending[i - 1];
 
-	if (!cached_events) {
-		cached_events = temp;
-	}
-	else {
-		prev = NULL;
-		next = cached_events;
-
-		/* Find the proper time slot */
-		while (next && next->time < current_time + delta) {
-			prev = next;
-			next = next->next;
-		}
+	pending[i].time = time;
+	pending[i].event = 0x80 | (info->event & 0x0F);
+	pending[i].note = info->basic.param1;
+	pending[i].velocity = info->basic.param2;
+	(*count)++;
+	return ~0;
+}
 
-		if (!next) {
-			prev->next = temp;
-		}
-		else {
-			if (prev) {
-				temp->next = prev->next;
-				prev->next = temp;
-			}
-			else {
-				temp->next = cached_events;
-				cached_events = temp;
-			}
-		}
-	}
+static int save_event(struct EventInfo* info, uint32_t current_time)
+{
+	uint32_t time = current_time + info->length;
+
+	debug("Saving event to be stopped at %2X\n", time);
+	if (!push_note_off(cached_events, &num_cached_events, MAX_CACHED_EVENTS, info, time))
+		return 0;
+
+	STATS_MAX(peak_pending, num_cached_events);
+	return ~0;
 }
 
-struct EventInfo* pop_cached_event(uint32_t current_time, uint32_t delta)
+int pop_cached_event(uint32_t current_time, uint32_t delta, struct EventInfo* info)
 {
-	struct EventInfo* info = NULL;
-	struct CachedEvent* old;
-
-	if (cached_events && cached_events->time < current_time + delta) {
-		info = cached_events->eventInfo;
-		info->delta = cached_events->time - current_time;
-		old = cached_events;
-		cached_events = cached_events->next;
-		free(old);
-	}
-	
-	return info;
+	struct PendingNoteOff* next;
+
+	if (!num_cached_events)
+		return 0;
+
+	next = &cached_events[num_cached_events - 1];
+	if (next->time >= current_time + delta)
+		return 0;
+
+	info->start = NULL;
+	info->delta = next->time - current_time;
+	info->event = next->event;
+	info->basic.param1 = next->note;
+	info->basic.param2 = next->velocity;
+	info->length = 0;
+	num_cached_events--;
+	return ~0;
+}
+
+void clear_cached_events(void)
+{
+	num_cached_events = 0;
 }
 
-int read_event_info(uint8_t* data, struct EventInfo* info, uint32_t current_time)
+int decode_event(uint8_t* data, struct EventInfo* info)
 {
-	struct EventInfo* injectedEvent;
 	info->start = data;
 	info->delta = readVLQ2(&data);
 	info->event = *data++;
+	info->length = 0;
 
-	/* Advance current time here, but not yet in the main conversion loop.
-	 * This is so that cached events can still be injected correctly */
-	current_time += info->delta;
-	
-	printf("%02X: Parsing event %02X\n", current_time, info->event);
 	switch (info->event >> 4) {
 	case 0x9: // Note On
 		info->basic.param1 = *(data++);
@@ -125,15 +125,6 @@ int read_event_info(uint8_t* data, struct EventInfo* info, uint32_t current_time
 			info->event = (info->event & 0x0F) | 0x80;
 			info->length = 0;
 		}
-		else {
-			printf("Found Note On with duration %X. Saving a Note Off for later\n", info->length);
-			injectedEvent = malloc(sizeof(struct EventInfo));
-			injectedEvent->event = 0x80 | info->event & 0x0f;
-			injectedEvent->basic.param1 = info->basic.param1;
-			injectedEvent->basic.param2 = info->basic.param2;
-			injectedEvent->length = info->length;
-			save_event(injectedEvent, current_time);
-		}
 		break;
 
 	case 0xC:
@@ -194,25 +185,15 @@ int read_event_info(uint8_t* data, struct EventInfo* info, uint32_t current_time
 			break;
 
 		case 0x77:	// XMIDI_CONTROLLER_CALLBACK_TRIG
-#if 0 // TODO
-			if (_callbackProc)
-				_callbackProc(info->basic.param2, _callbackData);
-#endif
+			// Passed on as is. The converter reports it, with its
+			// timestamp, once the event has been written out.
 			break;
 
-		case 0x6e:	// XMIDI_CONTROLLER_CHAN_LOCK
-		case 0x6f:	// XMIDI_CONTROLLER_CHAN_LOCK_PROT
-		case 0x70:	// XMIDI_CONTROLLER_VOICE_PROT
-		case 0x71:	// XMIDI_CONTROLLER_TIMBRE_PROT
-		case 0x72:	// XMIDI_CONTROLLER_BANK_CHANGE
-		case 0x73:	// XMIDI_CONTROLLER_IND_CTRL_PREFIX
-		case 0x76:	// XMIDI_CONTROLLER_CLEAR_BB_COUNT
-		case 0x78:	// XMIDI_CONTROLLER_SEQ_BRANCH_INDEX
 		default:
-			if (info->basic.param1 >= 0x6e && info->basic.param1 <= 0x78) {
-				warning("Unsupported XMIDI controller %d (0x%2x)",
-					info->basic.param1, info->basic.param1);
-			}
+			// Anything else is passed on as is. read_event_info()
+			// reports the XMIDI controllers that aren't supported,
+			// as the sequencer calls this while playing.
+			break;
 		}
 
 		// Should we really keep passing the XMIDI controller events to
@@ -254,16 +235,9 @@ int read_event_info(uint8_t* data, struct EventInfo* info, uint32_t current_time
 			info->length = readVLQ(&data);
 			info->ext.data = data;
 			data += info->length;
-			if (info->ext.type == 0x51 && info->length == 3) {
-				// Tempo event. We want to make these constant 500,000.
-				info->ext.data[0] = 0x07;
-				info->ext.data[1] = 0xA1;
-				info->ext.data[2] = 0x20;
-			}
 			break;
 
 		default:
-			warning("MidiParser_XMIDI::parseNextEvent: Unsupported event code %x (delta: %X)", info->event, info->delta);
 			return 0;
 		}
 	}
@@ -271,3 +245,56 @@ int read_event_info(uint8_t* data, struct EventInfo* info, uint32_t current_time
 	return (data - info->start);
 }
 
+/* Whether controller is an XMIDI extension that is passed on without
+ * being acted upon */
+static int unsupported_controller(uint8_t controller)
+{
+	switch (controller) {
+	case 0x6e:	// XMIDI_CONTROLLER_CHAN_LOCK
+	case 0x6f:	// XMIDI_CONTROLLER_CHAN_LOCK_PROT
+	case 0x70:	// XMIDI_CONTROLLER_VOICE_PROT
+	case 0x71:	// XMIDI_CONTROLLER_TIMBRE_PROT
+	case 0x73:	// XMIDI_CONTROLLER_IND_CTRL_PREFIX
+	case 0x76:	// XMIDI_CONTROLLER_CLEAR_BB_COUNT
+	case 0x78:	// XMIDI_CONTROLLER_SEQ_BRANCH_INDEX
+		return 1;
+	}
+	return 0;
+}
+
+int read_event_info(uint8_t* data, struct EventInfo* info, uint32_t current_time, int* skip)
+{
+	int rc;
+
+	*skip = 0;
+
+	rc = decode_event(data, info);
+	if (!rc) {
+		warning("MidiParser_XMIDI::parseNextEvent: Unsupported event code %x (delta: %X)", info->event, info->delta);
+		return 0;
+	}
+
+	if ((info->event & 0xF0) == 0xB0 && unsupported_controller(info->basic.param1)) {
+		warning("Unsupported XMIDI controller %d (0x%2x)",
+			info->basic.param1, info->basic.param1);
+	}
+
+	/* Advance current time here, but not yet in the main conversion loop.
+	 * This is so that cached events can still be injected correctly */
+	current_time += info->delta;
+
+	debug("%02X: Parsing event %02X\n", current_time, info->event);
+	if ((info->event & 0xF0) == 0x90) {
+		debug("Found Note On with duration %X. Saving a Note Off for later\n", info->length);
+		if (!save_event(info, current_time))
+			*skip = 1;
+	}
+	else if (info->event == 0xFF && info->ext.type == 0x51 && info->length == 3) {
+		// Tempo event. We want to make these constant 500,000.
+		info->ext.data[0] = 0x07;
+		info->ext.data[1] = 0xA1;
+		info->ext.data[2] = 0x20;
+	}
+
+	return rc;
+}
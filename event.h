@@ -32,10 +32,39 @@ struct EventInfo {
 	               ///< For all other events, this value should always be zero.
 };
 
-int read_event_info(uint8_t* data, struct EventInfo* info, uint32_t current_time);
+#define MAX_CACHED_EVENTS 1024 // Maximum number of notes playing at once
 
-/* Returns an EventInfo struct if there is a cached event that should be
- * played between current_time and current_time + delta. The cached event
- * is removed from the internal list of cached events! */
-struct EventInfo* pop_cached_event(uint32_t current_time, uint32_t delta);
+/* A Note Off that is to be injected at a later time */
+struct PendingNoteOff {
+	uint32_t time;    ///< Absolute tick at which the note should stop
+	uint8_t event;    ///< Note Off command with channel
+	uint8_t note;
+	uint8_t velocity;
+};
+
+/* Adds the Note Off for the Note On in info, due at tick time, to pending,
+ * which holds *count of at most max entries sorted latest first. Among
+ * Note Offs due at the same time, the one added last comes out first.
+ * Returns 0 if pending is full, in which case the Note On is to be left
+ * out rather than left hanging. */
+int push_note_off(struct PendingNoteOff* pending, int* count, int max,
+                  struct EventInfo* info, uint32_t time);
+
+/* Decodes the event at data into info without any side effects, i.e. no
+ * Note Off is saved for later, the data is left untouched and nothing is
+ * logged. Returns the number of bytes consumed, or 0 on error. */
+int decode_event(uint8_t* data, struct EventInfo* info);
+
+/* Like decode_event(), but also saves the Note Off of a Note On for
+ * pop_cached_event(). If MAX_CACHED_EVENTS notes are playing already, the
+ * Note On is to be left out instead, which is signalled through *skip. */
+int read_event_info(uint8_t* data, struct EventInfo* info, uint32_t current_time, int* skip);
+
+/* Fills in info if there is a cached event that should be played between
+ * current_time and current_time + delta, and returns non-zero. The cached
+ * event is removed from the internal list of cached events! */
+int pop_cached_event(uint32_t current_time, uint32_t delta, struct EventInfo* info);
+
+/* Forgets all cached events, e.g. Note Offs left over after End of Track */
+void clear_cached_events(void);
 #endif
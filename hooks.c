@@ -0,0 +1,166 @@
+#include "hooks.h"
+#include "stats.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16 // Also the size of the header in front of each block
+
+static void* default_alloc(size_t size, void* data)
+{
+	return malloc(size);
+}
+
+static void* default_realloc(void* ptr, size_t size, void* data)
+{
+	return realloc(ptr, size);
+}
+
+static void default_free(void* ptr, void* data)
+{
+	free(ptr);
+}
+
+static void default_log(const char* message, void* data)
+{
+	fprintf(stderr, "%s\n", message);
+}
+
+static alloc_proc alloc_hook = default_alloc;
+static realloc_proc realloc_hook = default_realloc;
+static free_proc free_hook = default_free;
+static void* alloc_data = NULL;
+
+static log_proc log_hook = default_log;
+static void* log_data = NULL;
+
+void set_XMIDI_allocator(alloc_proc alloc_fn, realloc_proc realloc_fn, free_proc free_fn, void* data)
+{
+	alloc_hook = alloc_fn ? alloc_fn : default_alloc;
+	realloc_hook = realloc_fn ? realloc_fn : default_realloc;
+	free_hook = free_fn ? free_fn : default_free;
+	alloc_data = data;
+}
+
+void set_XMIDI_log(log_proc proc, void* data)
+{
+	log_hook = proc;
+	log_data = data;
+}
+
+void get_XMIDI_log(log_proc* proc, void** data)
+{
+	*proc = log_hook;
+	*data = log_data;
+}
+
+void reset_XMIDI_log(void)
+{
+	log_hook = default_log;
+	log_data = NULL;
+}
+
+void* xmidi_alloc(size_t size)
+{
+	STATS_ADD(allocations, 1);
+	return alloc_hook(size, alloc_data);
+}
+
+void* xmidi_realloc(void* ptr, size_t size)
+{
+	STATS_ADD(allocations, 1);
+	return realloc_hook(ptr, size, alloc_data);
+}
+
+void xmidi_free(void* ptr)
+{
+	if (ptr)
+		free_hook(ptr, alloc_data);
+}
+
+void xmidi_warning(const char* format, ...)
+{
+	char message[256];
+	va_list args;
+
+	if (!log_hook)
+		return;
+
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	log_hook(message, log_data);
+}
+
+/* Each arena block is preceded by a header holding its size */
+static void* arena_alloc(size_t size, void* data)
+{
+	struct XMIDI_arena* arena = data;
+	size_t needed = ARENA_ALIGN + ((size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+	uint8_t* block;
+
+	if (arena->size - arena->used < needed)
+		return NULL;
+
+	block = arena->base + arena->used;
+	memcpy(block, &size, sizeof(size));
+	arena->last = arena->used;
+	arena->used += needed;
+	return block + ARENA_ALIGN;
+}
+
+static void* arena_realloc(void* ptr, size_t size, void* data)
+{
+	struct XMIDI_arena* arena = data;
+	uint8_t* block;
+	size_t old_size;
+	void* temp;
+
+	if (!ptr)
+		return arena_alloc(size, data);
+
+	block = (uint8_t*)ptr - ARENA_ALIGN;
+	memcpy(&old_size, block, sizeof(old_size));
+
+	// The most recent block can simply grow or shrink in place
+	if (block == arena->base + arena->last) {
+		arena->used = arena->last;
+		temp = arena_alloc(size, data);
+		if (!temp)
+			arena->used = arena->last + ARENA_ALIGN + ((old_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+		return temp;
+	}
+
+	temp = arena_alloc(size, data);
+	if (temp)
+		memcpy(temp, ptr, old_size < size ? old_size : size);
+	return temp;
+}
+
+static void arena_free(void* ptr, void* data)
+{
+	struct XMIDI_arena* arena = data;
+	uint8_t* block = (uint8_t*)ptr - ARENA_ALIGN;
+
+	if (block == arena->base + arena->last)
+		arena->used = arena->last;
+}
+
+void use_XMIDI_arena(struct XMIDI_arena* arena, void* buffer, size_t size)
+{
+	size_t misalign = (uintptr_t)buffer & (ARENA_ALIGN - 1);
+
+	if (misalign) {
+		misalign = ARENA_ALIGN - misalign;
+		buffer = (uint8_t*)buffer + (misalign < size ? misalign : size);
+		size -= misalign < size ? misalign : size;
+	}
+
+	arena->base = buffer;
+	arena->size = size;
+	arena->used = 0;
+	arena->last = 0;
+	set_XMIDI_allocator(arena_alloc, arena_realloc, arena_free, arena);
+}
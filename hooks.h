@@ -0,0 +1,40 @@
+#ifndef HOOKS_H
+#define HOOKS_H
+#include <inttypes.h>
+#include <stddef.h>
+
+typedef void* (*alloc_proc)(size_t size, void* data);
+typedef void* (*realloc_proc)(void* ptr, size_t size, void* data);
+typedef void (*free_proc)(void* ptr, void* data);
+typedef void (*log_proc)(const char* message, void* data);
+
+/* Every allocation made by the library goes through these. The defaults
+ * are malloc, realloc and free. */
+void set_XMIDI_allocator(alloc_proc alloc_fn, realloc_proc realloc_fn, free_proc free_fn, void* data);
+
+/* Warnings are written to stderr unless a log proc is set. Setting a NULL
+ * proc silences them. */
+void set_XMIDI_log(log_proc proc, void* data);
+void get_XMIDI_log(log_proc* proc, void** data);
+void reset_XMIDI_log(void);
+
+/**
+ * A caller supplied block of memory to allocate from, so that the library
+ * never touches the heap. Freeing only gives memory back if it was the
+ * last allocation; set used to 0 to reuse the whole arena.
+ */
+struct XMIDI_arena {
+	uint8_t* base;
+	size_t size;
+	size_t used;
+	size_t last; ///< Offset of the most recent allocation
+};
+
+/* Installs an allocator handing out memory from buffer */
+void use_XMIDI_arena(struct XMIDI_arena* arena, void* buffer, size_t size);
+
+void* xmidi_alloc(size_t size);
+void* xmidi_realloc(void* ptr, size_t size);
+void xmidi_free(void* ptr);
+void xmidi_warning(const char* format, ...);
+#endif
@@ -0,0 +1,247 @@
+#include "scanner.h"
+#include "xmidi_parser.h"
+#include "hooks.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define warning(...) xmidi_warning(__VA_ARGS__)
+
+#define INDEX_MAGIC "XMIDI-INDEX 1"
+
+static uint32_t peek4high(uint8_t* d)
+{
+	return ((uint32_t)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+}
+
+uint8_t* map_archive(const char* path, size_t* size)
+{
+	struct stat st;
+	uint8_t* data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		warning("Failed to open archive '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) || !st.st_size) {
+		warning("Failed to get size of archive");
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		warning("Failed to map archive '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	*size = st.st_size;
+	return data;
+}
+
+void unmap_archive(uint8_t* data, size_t size)
+{
+	munmap(data, size);
+}
+
+/* Returns the size of the IFF structure at pos if it looks like a complete
+ * XMIDI file that fits within end, 0 otherwise */
+static uint32_t candidate_size(uint8_t* pos, uint8_t* end)
+{
+	uint64_t size, len;
+
+	if (end - pos < 12)
+		return 0;
+
+	len = peek4high(pos + 4);
+	size = 8 + ((len + 1) & ~1);
+	if (size > (uint64_t)(end - pos))
+		return 0;
+
+	if (!memcmp(pos + 8, "XMID", 4))
+		return size;
+
+	if (memcmp(pos + 8, "XDIR", 4))
+		return 0;
+
+	// The XDIR form is followed by the CAT holding the sequences
+	if ((uint64_t)(end - pos) < size + 12 || memcmp(pos + size, "CAT ", 4))
+		return 0;
+
+	len = peek4high(pos + size + 4);
+	size += 8 + ((len + 1) & ~1);
+	if (size > (uint64_t)(end - pos) || size > UINT32_MAX)
+		return 0;
+
+	return size;
+}
+
+int scan_archive(uint8_t* data, size_t size, struct ArchiveEntry** entries)
+{
+	struct ArchiveEntry* list = NULL,* temp;
+	struct XMIDI_info info;
+	uint8_t* pos = data;
+	uint8_t* end = data + size;
+	uint32_t len;
+	uint16_t num_tracks;
+	int count = 0, allocated = 0;
+	log_proc log;
+	void* log_data;
+	int rc;
+
+	/* memchr is vectorised in any decent libc, and as 'F' is rare in most
+	 * data it does nearly all of the work */
+	while ((pos = memchr(pos, 'F', end - pos))) {
+		if (end - pos < 4 || memcmp(pos, "FORM", 4)) {
+			pos++;
+			continue;
+		}
+
+		len = candidate_size(pos, end);
+		if (!len) {
+			pos++;
+			continue;
+		}
+
+		/* Rejected candidates and lone FORM XMIDs both log, which would
+		 * flood the log on a large archive */
+		get_XMIDI_log(&log, &log_data);
+		set_XMIDI_log(NULL, NULL);
+		rc = read_XMIDI_header(pos, len, &info);
+		set_XMIDI_log(log, log_data);
+		if (!rc) {
+			pos++;
+			continue;
+		}
+		num_tracks = info.num_tracks;
+		free_XMIDI_info(&info);
+
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 16;
+			temp = xmidi_realloc(list, allocated * sizeof(struct ArchiveEntry));
+			if (!temp) {
+				warning("Could not allocate memory for %d entries", allocated);
+				xmidi_free(list);
+				return -1;
+			}
+			list = temp;
+		}
+		list[count].offset = pos - data;
+		list[count].size = len;
+		list[count].num_tracks = num_tracks;
+		count++;
+
+		// The sequences inside belong to this entry
+		pos += len;
+	}
+
+	*entries = list;
+	return count;
+}
+
+int write_archive_index(const char* index_path, const char* archive_path,
+                        struct ArchiveEntry* entries, int count)
+{
+	struct stat st;
+	FILE* fp;
+	int i;
+
+	if (stat(archive_path, &st)) {
+		warning("Failed to stat archive '%s': %s", archive_path, strerror(errno));
+		return 0;
+	}
+
+	fp = fopen(index_path, "w");
+	if (!fp) {
+		warning("Failed to create index '%s': %s", index_path, strerror(errno));
+		return 0;
+	}
+
+	fprintf(fp, INDEX_MAGIC " %lld %lld %d\n", (long long)st.st_size,
+		(long long)st.st_mtime, count);
+	for (i = 0; i < count; i++) {
+		fprintf(fp, "%" PRIu64 " %" PRIu32 " %d\n", entries[i].offset,
+			entries[i].size, (int)entries[i].num_tracks);
+	}
+
+	if (fclose(fp)) {
+		warning("Failed to write index '%s': %s", index_path, strerror(errno));
+		return 0;
+	}
+	return ~0;
+}
+
+int read_archive_index(const char* index_path, const char* archive_path,
+                       struct ArchiveEntry** entries)
+{
+	struct ArchiveEntry* list;
+	struct stat st;
+	long long archive_size, archive_mtime;
+	int count, num_tracks, i, fd;
+	char magic[4];
+	FILE* fp;
+
+	if (stat(archive_path, &st))
+		return -1;
+
+	fp = fopen(index_path, "r");
+	if (!fp)
+		return -1;
+
+	if (fscanf(fp, INDEX_MAGIC " %lld %lld %d", &archive_size, &archive_mtime, &count) != 3
+	    || archive_size != st.st_size || archive_mtime != st.st_mtime || count < 0) {
+		fclose(fp);
+		return -1;
+	}
+
+	list = xmidi_alloc((count ? count : 1) * sizeof(struct ArchiveEntry));
+	if (!list) {
+		fclose(fp);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (fscanf(fp, "%" SCNu64 " %" SCNu32 " %d", &list[i].offset,
+		           &list[i].size, &num_tracks) != 3) {
+			warning("Index '%s' is truncated", index_path);
+			xmidi_free(list);
+			fclose(fp);
+			return -1;
+		}
+		list[i].num_tracks = num_tracks;
+	}
+	fclose(fp);
+
+	/* The size and mtime only catch most changes, and the index may have
+	 * been edited, so make sure every entry still points at an XMIDI file
+	 * within the archive before it is used to read from the mapping */
+	fd = open(archive_path, O_RDONLY);
+	if (fd < 0) {
+		xmidi_free(list);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (list[i].offset > (uint64_t)st.st_size
+		    || list[i].size > (uint64_t)st.st_size - list[i].offset
+		    || pread(fd, magic, 4, list[i].offset) != 4 || memcmp(magic, "FORM", 4)) {
+			warning("Index '%s' doesn't match the archive", index_path);
+			close(fd);
+			xmidi_free(list);
+			return -1;
+		}
+	}
+
+	close(fd);
+	*entries = list;
+	return count;
+}
@@ -0,0 +1,34 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+#include <inttypes.h>
+#include <stddef.h>
+
+/* A complete XMIDI file (FORM XDIR + CAT XMID, or a lone FORM XMID)
+ * found embedded in a larger archive */
+struct ArchiveEntry {
+	uint64_t offset;
+	uint32_t size;
+	uint16_t num_tracks;
+};
+
+/* Maps the whole file at path into memory. The mapping is private and
+ * writable, as the converter modifies the data it is handed. Returns NULL
+ * on failure. */
+uint8_t* map_archive(const char* path, size_t* size);
+void unmap_archive(uint8_t* data, size_t size);
+
+/* Finds all XMIDI files in data. Returns the number of entries stored in
+ * *entries, allocated with xmidi_alloc(), or -1 on failure. */
+int scan_archive(uint8_t* data, size_t size, struct ArchiveEntry** entries);
+
+/* The index is a text file remembering the entries found in archive_path,
+ * along with the archive size and modification time so that stale
+ * indexes are detected. read_archive_index() returns -1 if the index is
+ * missing or stale, or if any entry lies outside the archive or no longer
+ * starts with a FORM chunk. */
+int write_archive_index(const char* index_path, const char* archive_path,
+                        struct ArchiveEntry* entries, int count);
+/* Like scan_archive(), *entries must be released with xmidi_free() */
+int read_archive_index(const char* index_path, const char* archive_path,
+                       struct ArchiveEntry** entries);
+#endif
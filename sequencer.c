@@ -0,0 +1,233 @@
+#include "sequencer.h"
+#include "xmidi_parser.h"
+#include "hooks.h"
+
+#include <string.h>
+
+#define warning(...) xmidi_warning(__VA_ARGS__)
+
+int sequencer_init(struct Sequencer* seq, uint8_t* data, uint32_t size, int track)
+{
+	struct XMIDI_info info;
+	int rc;
+
+	if (!read_XMIDI_header(data, size, &info)) {
+		warning("Failed to read XMIDI header");
+		return 0;
+	}
+
+	rc = sequencer_init_info(seq, data, &info, track);
+	free_XMIDI_info(&info);
+	return rc;
+}
+
+int sequencer_init_info(struct Sequencer* seq, uint8_t* data, struct XMIDI_info* info, int track)
+{
+	memset(seq, 0, sizeof(*seq));
+	seq->tempo_percent = 100;
+	memset(seq->velocity_percent, 100, sizeof(seq->velocity_percent));
+
+	if (track < 0 || track >= info->num_tracks) {
+		warning("No track %d, there are only %d", track, (int)info->num_tracks);
+		return 0;
+	}
+
+	seq->data = data + info->tracks[track].evnt.offset;
+	seq->data_end = seq->data + info->tracks[track].evnt.length;
+	return ~0;
+}
+
+/* Applies transpose and velocity scaling to a Note On or Note Off */
+static void apply_controls(struct Sequencer* seq, struct EventInfo* info)
+{
+	int channel = info->event & 0x0F;
+	int value;
+
+	value = info->basic.param1 + seq->transpose[channel];
+	if (value < 0)
+		value = 0;
+	else if (value > 127)
+		value = 127;
+	info->basic.param1 = value;
+
+	if ((info->event & 0xF0) == 0x90) {
+		value = info->basic.param2 * seq->velocity_percent[channel] / 100;
+		if (value < 1)
+			value = 1; // Zero would turn it into a Note Off
+		else if (value > 127)
+			value = 127;
+		info->basic.param2 = value;
+	}
+}
+
+static void decode_next(struct Sequencer* seq)
+{
+	int rc;
+
+	if (seq->data >= seq->data_end) {
+		seq->finished = 1;
+		return;
+	}
+
+	rc = decode_event(seq->data, &seq->next);
+	if (!rc) {
+		warning("Failed to decode event, stopping sequence");
+		seq->finished = 1;
+		return;
+	}
+	seq->data += rc;
+	seq->decode_time += seq->next.delta;
+
+	// The end of track is implied by sequencer_done()
+	if (seq->next.event == 0xFF && seq->next.ext.type == 0x2F) {
+		seq->finished = 1;
+		return;
+	}
+
+	seq->next_time = seq->decode_time;
+	seq->have_next = 1;
+}
+
+int sequencer_pop_event(struct Sequencer* seq, uint32_t until, struct EventInfo* out)
+{
+	struct PendingNoteOff* note_off;
+
+	for (;;) {
+		if (!seq->have_next && !seq->finished)
+			decode_next(seq);
+
+		note_off = seq->num_pending ? &seq->pending[seq->num_pending - 1] : NULL;
+
+		if (note_off && (!seq->have_next || note_off->time <= seq->next_time)) {
+			if (note_off->time > until)
+				return 0;
+
+			out->start = NULL;
+			out->delta = note_off->time - seq->last_time;
+			out->event = note_off->event;
+			out->basic.param1 = note_off->note;
+			out->basic.param2 = note_off->velocity;
+			out->length = 0;
+			seq->last_time = note_off->time;
+			seq->num_pending--;
+			return ~0;
+		}
+		else if (seq->have_next) {
+			if (seq->next_time > until)
+				return 0;
+
+			seq->have_next = 0;
+			*out = seq->next;
+
+			switch (out->event & 0xF0) {
+			case 0x90:
+				if (seq->muted & (1 << (out->event & 0x0F)))
+					continue;
+				/* The Note Off is queued already transposed, so that it
+				 * matches even if the transpose changes in between */
+				apply_controls(seq, out);
+				if (!push_note_off(seq->pending, &seq->num_pending, SEQUENCER_MAX_PENDING,
+				                   out, seq->next_time + out->length)) {
+					seq->dropped_notes++;
+					continue;
+				}
+				break;
+
+			case 0x80:
+				apply_controls(seq, out);
+				break;
+			}
+
+			out->delta = seq->next_time - seq->last_time;
+			seq->last_time = seq->next_time;
+			return ~0;
+		}
+		else {
+			return 0;
+		}
+	}
+}
+
+int sequencer_next_time(struct Sequencer* seq, uint32_t* time)
+{
+	if (!seq->have_next && !seq->finished)
+		decode_next(seq);
+
+	if (seq->num_pending && (!seq->have_next || seq->pending[seq->num_pending - 1].time <= seq->next_time))
+		*time = seq->pending[seq->num_pending - 1].time;
+	else if (seq->have_next)
+		*time = seq->next_time;
+	else
+		return 0;
+
+	return ~0;
+}
+
+int sequencer_advance(struct Sequencer* seq, uint32_t elapsed_us, struct EventInfo* out, int max)
+{
+	int count = 0;
+
+	/* Keep the leftover in units of 1 / (XMIDI_PPQN * 100) us so no time
+	 * is lost, whatever the tempo */
+	seq->remainder += (uint64_t)elapsed_us * XMIDI_PPQN * seq->tempo_percent;
+	seq->now += seq->remainder / (XMIDI_TEMPO * 100);
+	seq->remainder %= XMIDI_TEMPO * 100;
+
+	while (count < max && sequencer_pop_event(seq, seq->now, &out[count]))
+		count++;
+
+	return count;
+}
+
+void sequencer_stop(struct Sequencer* seq, uint32_t time)
+{
+	int i;
+
+	seq->finished = 1;
+	seq->have_next = 0;
+
+	/* Note Offs that were due later now stop at time. Capping them keeps
+	 * the queue sorted. */
+	for (i = 0; i < seq->num_pending; i++) {
+		if (seq->pending[i].time > time)
+			seq->pending[i].time = time;
+	}
+}
+
+int sequencer_done(struct Sequencer* seq)
+{
+	return seq->finished && !seq->have_next && !seq->num_pending;
+}
+
+void sequencer_set_tempo(struct Sequencer* seq, unsigned int percent)
+{
+	if (percent < 1)
+		percent = 1;
+	else if (percent > 0xFFFF)
+		percent = 0xFFFF;
+	seq->tempo_percent = percent;
+}
+
+void sequencer_set_transpose(struct Sequencer* seq, int channel, int semitones)
+{
+	if (semitones < -127)
+		semitones = -127;
+	else if (semitones > 127)
+		semitones = 127;
+	seq->transpose[channel & 0x0F] = semitones;
+}
+
+void sequencer_set_velocity(struct Sequencer* seq, int channel, unsigned int percent)
+{
+	if (percent > 255)
+		percent = 255;
+	seq->velocity_percent[channel & 0x0F] = percent;
+}
+
+void sequencer_set_mute(struct Sequencer* seq, int channel, int mute)
+{
+	if (mute)
+		seq->muted |= 1 << (channel & 0x0F);
+	else
+		seq->muted &= ~(1 << (channel & 0x0F));
+}
@@ -0,0 +1,86 @@
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+#include <inttypes.h>
+
+#include "event.h"
+#include "xmidi_parser.h"
+
+#define SEQUENCER_MAX_PENDING 128 // Maximum number of sounding notes
+
+/**
+ * Pull-based player for a single XMIDI sequence. Events are decoded from
+ * the EVNT data only as they become due, and the Note Offs implied by
+ * XMIDI Note On durations are kept in a fixed size queue, so advancing
+ * never allocates memory.
+ *
+ * Like the converter, playback runs at a constant XMIDI_TEMPO and
+ * XMIDI_PPQN. Tempo meta events are passed on but otherwise ignored.
+ *
+ * Tempo, transpose, velocity and mute can be changed at any time between
+ * calls to sequencer_advance() and take effect with the next event.
+ */
+struct Sequencer {
+	uint8_t* data;           ///< Next event to decode
+	uint8_t* data_end;
+	uint32_t decode_time;    ///< Absolute tick of the last decoded event
+	uint32_t last_time;      ///< Absolute tick of the last returned event
+	uint32_t now;            ///< Events up to and including this tick are due
+	uint64_t remainder;      ///< Elapsed time not yet making up a whole tick
+	struct EventInfo next;   ///< Decoded, but not yet returned, event
+	uint32_t next_time;
+	int have_next;
+	int finished;            ///< No more events to decode
+	struct PendingNoteOff pending[SEQUENCER_MAX_PENDING]; ///< Latest first
+	int num_pending;
+	uint32_t dropped_notes;  ///< Note Ons skipped because pending was full
+	uint16_t tempo_percent;  ///< Playback speed, 100 is as authored
+	int8_t transpose[16];    ///< Semitones added to notes, per channel
+	uint8_t velocity_percent[16]; ///< Note On velocity scale, per channel
+	uint16_t muted;          ///< One bit per channel, muted channels get no new notes
+};
+
+/* Prepares seq for playing the given track of the XMIDI file in data.
+ * Note that data must persist for as long as seq is used. Returns 0 on
+ * failure. */
+int sequencer_init(struct Sequencer* seq, uint8_t* data, uint32_t size, int track);
+
+/* Like sequencer_init(), but uses an index from read_XMIDI_header(). Only
+ * data needs to persist, info can be released once this returns. */
+int sequencer_init_info(struct Sequencer* seq, uint8_t* data, struct XMIDI_info* info, int track);
+
+/* Moves playback elapsed_us microseconds forward and stores up to max of
+ * the events that became due in out, in playback order. The delta of each
+ * returned event is the number of ticks since the previously returned
+ * event. Events that don't fit in out are returned by the next call.
+ * Returns the number of events stored. */
+int sequencer_advance(struct Sequencer* seq, uint32_t elapsed_us, struct EventInfo* out, int max);
+
+/* Sets the playback speed, e.g. 200 plays twice as fast as authored */
+void sequencer_set_tempo(struct Sequencer* seq, unsigned int percent);
+
+/* Shifts all notes started on channel from now on by semitones */
+void sequencer_set_transpose(struct Sequencer* seq, int channel, int semitones);
+
+/* Scales the velocity of all notes started on channel from now on */
+void sequencer_set_velocity(struct Sequencer* seq, int channel, unsigned int percent);
+
+/* Stops new notes from being started on channel. Sounding notes still get
+ * their Note Off, and all other events are passed on so that the channel
+ * state is correct once it is unmuted. */
+void sequencer_set_mute(struct Sequencer* seq, int channel, int mute);
+
+/* Building blocks of sequencer_advance(), for driving playback from an
+ * external clock. sequencer_next_time() stores the absolute tick of the
+ * next event in time, returning 0 if there is none. sequencer_pop_event()
+ * stores the next event in out and returns non-zero, provided that it is
+ * due at or before tick until. */
+int sequencer_next_time(struct Sequencer* seq, uint32_t* time);
+int sequencer_pop_event(struct Sequencer* seq, uint32_t until, struct EventInfo* out);
+
+/* Ends the sequence early at the given tick, normally seq->now. The Note
+ * Offs for all notes still sounding then become due at that tick. */
+void sequencer_stop(struct Sequencer* seq, uint32_t time);
+
+/* Returns non-zero once every event, including Note Offs, has been returned */
+int sequencer_done(struct Sequencer* seq);
+#endif
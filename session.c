@@ -0,0 +1,244 @@
+#include "session.h"
+#include "xmidi_parser.h"
+#include "hooks.h"
+
+#include <string.h>
+
+#define warning(...) xmidi_warning(__VA_ARGS__)
+
+#define PERCUSSION_CHANNEL 9
+
+void session_init(struct Session* session)
+{
+	memset(session, 0, sizeof(*session));
+	memset(session->channel_owner, -1, sizeof(session->channel_owner));
+	session->tempo_percent = 100;
+}
+
+static int queue_before(struct Session* session, int a, int b)
+{
+	return session->layers[session->queue[a]].next_time < session->layers[session->queue[b]].next_time;
+}
+
+static void queue_swap(struct Session* session, int a, int b)
+{
+	int temp = session->queue[a];
+	session->queue[a] = session->queue[b];
+	session->queue[b] = temp;
+}
+
+static void sift_up(struct Session* session, int i)
+{
+	while (i > 0 && queue_before(session, i, (i - 1) / 2)) {
+		queue_swap(session, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void sift_down(struct Session* session, int i)
+{
+	int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= session->queue_size)
+			break;
+		if (child + 1 < session->queue_size && queue_before(session, child + 1, child))
+			child++;
+		if (!queue_before(session, child, i))
+			break;
+		queue_swap(session, i, child);
+		i = child;
+	}
+}
+
+static void release_channels(struct Session* session, int layer)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		if (session->channel_owner[i] == layer)
+			session->channel_owner[i] = -1;
+	}
+	session->layers[layer].active = 0;
+}
+
+/* Finds the layer's next event, or takes it off the queue if it is done.
+ * The layer must be at the top of the queue. */
+static void requeue_top(struct Session* session)
+{
+	struct SessionLayer* layer = &session->layers[session->queue[0]];
+	uint32_t time;
+
+	if (sequencer_next_time(&layer->seq, &time)) {
+		layer->next_time = layer->start + time;
+		sift_down(session, 0);
+		return;
+	}
+
+	release_channels(session, session->queue[0]);
+	session->queue[0] = session->queue[--session->queue_size];
+	sift_down(session, 0);
+}
+
+static int map_channel(struct Session* session, int layer, int channel)
+{
+	struct SessionLayer* l = &session->layers[layer];
+	int i;
+
+	if (l->channel_map[channel] != 0xFF)
+		return l->channel_map[channel];
+
+	if (channel == PERCUSSION_CHANNEL) {
+		l->channel_map[channel] = PERCUSSION_CHANNEL;
+		return PERCUSSION_CHANNEL;
+	}
+
+	// Prefer the channel the sequence asked for
+	if (session->channel_owner[channel] < 0) {
+		i = channel;
+	}
+	else {
+		for (i = 0; i < 16; i++) {
+			if (i != PERCUSSION_CHANNEL && session->channel_owner[i] < 0)
+				break;
+		}
+	}
+
+	if (i == 16) {
+		warning("Out of channels, layer %d has to share channel %d", layer, channel);
+		i = channel;
+	}
+	else {
+		session->channel_owner[i] = layer;
+	}
+
+	l->channel_map[channel] = i;
+	return i;
+}
+
+int session_add_layer(struct Session* session, uint8_t* data, struct XMIDI_info* info, int track,
+                      unsigned int volume)
+{
+	struct SessionLayer* l;
+	uint32_t time;
+	int layer;
+
+	for (layer = 0; layer < SESSION_MAX_LAYERS; layer++) {
+		if (!session->layers[layer].active)
+			break;
+	}
+	if (layer == SESSION_MAX_LAYERS) {
+		warning("Can only play %d layers at once", SESSION_MAX_LAYERS);
+		return -1;
+	}
+
+	l = &session->layers[layer];
+	if (!sequencer_init_info(&l->seq, data, info, track))
+		return -1;
+
+	l->active = 1;
+	l->start = session->now;
+	memset(l->channel_map, 0xFF, sizeof(l->channel_map));
+	session_set_volume(session, layer, volume);
+
+	if (!sequencer_next_time(&l->seq, &time)) {
+		l->active = 0;
+		return layer; // Nothing to play, so done already
+	}
+
+	l->next_time = l->start + time;
+	session->queue[session->queue_size] = layer;
+	sift_up(session, session->queue_size++);
+	return layer;
+}
+
+void session_stop_layer(struct Session* session, int layer)
+{
+	struct SessionLayer* l;
+	uint32_t time;
+	int i;
+
+	if (layer < 0 || layer >= SESSION_MAX_LAYERS || !session->layers[layer].active)
+		return;
+
+	l = &session->layers[layer];
+	sequencer_stop(&l->seq, session->now - l->start);
+
+	for (i = 0; i < session->queue_size; i++) {
+		if (session->queue[i] != layer)
+			continue;
+
+		/* Without any Note Offs left, the layer is simply taken off
+		 * the queue when it comes up */
+		l->next_time = session->now;
+		if (sequencer_next_time(&l->seq, &time))
+			l->next_time = l->start + time;
+		sift_up(session, i);
+		sift_down(session, i);
+		break;
+	}
+}
+
+void session_set_volume(struct Session* session, int layer, unsigned int percent)
+{
+	if (layer < 0 || layer >= SESSION_MAX_LAYERS)
+		return;
+	session->layers[layer].volume = percent > 255 ? 255 : percent;
+}
+
+void session_set_tempo(struct Session* session, unsigned int percent)
+{
+	if (percent < 1)
+		percent = 1;
+	else if (percent > 0xFFFF)
+		percent = 0xFFFF;
+	session->tempo_percent = percent;
+}
+
+int session_advance(struct Session* session, uint32_t elapsed_us, struct EventInfo* out, int max)
+{
+	struct SessionLayer* l;
+	uint32_t time;
+	int count = 0;
+	int value;
+
+	/* Same as sequencer_advance(), see there */
+	session->remainder += (uint64_t)elapsed_us * XMIDI_PPQN * session->tempo_percent;
+	session->now += session->remainder / (XMIDI_TEMPO * 100);
+	session->remainder %= XMIDI_TEMPO * 100;
+
+	while (count < max && session->queue_size) {
+		l = &session->layers[session->queue[0]];
+		if (l->next_time > session->now)
+			break;
+
+		/* Only take events up to next_time, as skipped (e.g. muted)
+		 * events could otherwise let a later event jump the queue */
+		if (sequencer_pop_event(&l->seq, l->next_time - l->start, &out[count])) {
+			time = l->start + l->seq.last_time;
+			out[count].delta = time - session->last_time;
+			session->last_time = time;
+
+			if (out[count].event >= 0x80 && out[count].event < 0xF0) {
+				out[count].event = (out[count].event & 0xF0) |
+					map_channel(session, session->queue[0], out[count].event & 0x0F);
+
+				if ((out[count].event & 0xF0) == 0x90) {
+					value = out[count].basic.param2 * l->volume / 100;
+					out[count].basic.param2 = value < 1 ? 1 : value > 127 ? 127 : value;
+				}
+			}
+			count++;
+		}
+
+		requeue_top(session);
+	}
+
+	return count;
+}
+
+int session_done(struct Session* session)
+{
+	return !session->queue_size;
+}
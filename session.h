@@ -0,0 +1,58 @@
+#ifndef SESSION_H
+#define SESSION_H
+#include <inttypes.h>
+
+#include "sequencer.h"
+
+#define SESSION_MAX_LAYERS 8
+
+struct SessionLayer {
+	struct Sequencer seq;    ///< Transpose and mute can be set on this directly
+	int active;
+	uint32_t start;          ///< Session tick at which the layer was added
+	uint32_t next_time;      ///< Session tick of the next event, the queue key
+	uint8_t volume;          ///< Note On velocity scale in percent
+	uint8_t channel_map[16]; ///< Output channel per sequence channel, 0xFF if none yet
+};
+
+/**
+ * Plays several XMIDI sequences (layers) at once, e.g. a music bed with
+ * stingers on top, as a single event stream. Each layer gets its own
+ * output channels as it starts using them, percussion stays on channel 9
+ * for everybody. Layers wait in a queue ordered by their next event, so
+ * only layers that actually have events due are looked at. Like the
+ * sequencer, a session never allocates memory.
+ */
+struct Session {
+	struct SessionLayer layers[SESSION_MAX_LAYERS];
+	int queue[SESSION_MAX_LAYERS]; ///< Min-heap of layers by next_time
+	int queue_size;
+	int8_t channel_owner[16];      ///< Layer using each output channel, or -1
+	uint32_t now;                  ///< Events up to and including this tick are due
+	uint32_t last_time;            ///< Session tick of the last returned event
+	uint64_t remainder;            ///< Elapsed time not yet making up a whole tick
+	uint16_t tempo_percent;        ///< Playback speed of all layers
+};
+
+void session_init(struct Session* session);
+
+/* Starts playing the given track of data as a new layer, from the current
+ * position on, using an index from read_XMIDI_header(). Several layers can
+ * share one index, which can be released once they are added, but data
+ * must persist until the layer is done. Returns the layer number, or -1 on
+ * failure. */
+int session_add_layer(struct Session* session, uint8_t* data, struct XMIDI_info* info, int track,
+                      unsigned int volume);
+
+/* Ends a layer early, stopping its sounding notes */
+void session_stop_layer(struct Session* session, int layer);
+
+void session_set_volume(struct Session* session, int layer, unsigned int percent);
+void session_set_tempo(struct Session* session, unsigned int percent);
+
+/* Like sequencer_advance(), for all layers at once */
+int session_advance(struct Session* session, uint32_t elapsed_us, struct EventInfo* out, int max);
+
+/* Returns non-zero if no layer has anything left to play */
+int session_done(struct Session* session);
+#endif
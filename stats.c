@@ -0,0 +1,34 @@
+#include "stats.h"
+
+#include <time.h>
+
+struct XMIDI_stats* xmidi_stats = NULL;
+
+uint64_t stats_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void print_stats_json(FILE* fp, struct XMIDI_stats* stats)
+{
+	fprintf(fp, "{\"phases_ns\": {"
+		"\"read_file\": %" PRIu64 ", "
+		"\"read_header\": %" PRIu64 ", "
+		"\"dry_run\": %" PRIu64 ", "
+		"\"convert\": %" PRIu64 ", "
+		"\"load_music\": %" PRIu64 "}, ",
+		stats->read_file_ns, stats->read_header_ns, stats->dry_run_ns,
+		stats->convert_ns, stats->load_music_ns);
+	fprintf(fp, "\"events_decoded\": %" PRIu32 ", "
+		"\"note_offs_injected\": %" PRIu32 ", "
+		"\"peak_pending\": %" PRIu32 ", "
+		"\"dropped_notes\": %" PRIu32 ", "
+		"\"bytes_in\": %" PRIu32 ", "
+		"\"bytes_out\": %" PRIu32 ", "
+		"\"allocations\": %" PRIu32 "}\n",
+		stats->events_decoded, stats->note_offs_injected, stats->peak_pending,
+		stats->dropped_notes, stats->bytes_in, stats->bytes_out, stats->allocations);
+}
@@ -0,0 +1,35 @@
+#ifndef STATS_H
+#define STATS_H
+#include <inttypes.h>
+#include <stdio.h>
+
+/**
+ * Timings (in ns, from the monotonic clock) and counters for one run.
+ * Only collected while xmidi_stats points to an instance.
+ */
+struct XMIDI_stats {
+	uint64_t read_file_ns;
+	uint64_t read_header_ns;     ///< Summed over all calls
+	uint64_t dry_run_ns;         ///< First convert_to_mtrk pass, sizing only
+	uint64_t convert_ns;         ///< Second convert_to_mtrk pass
+	uint64_t load_music_ns;
+	uint32_t events_decoded;     ///< By the converting pass only
+	uint32_t note_offs_injected; ///< By the converting pass only
+	uint32_t peak_pending;       ///< Most Note Offs waiting at any one time
+	uint32_t dropped_notes;      ///< Note Ons left out as MAX_CACHED_EVENTS were playing
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+	uint32_t allocations;
+};
+
+extern struct XMIDI_stats* xmidi_stats;
+
+#define STATS_ADD(field, n) do { if (xmidi_stats) xmidi_stats->field += (n); } while (0)
+#define STATS_MAX(field, n) do { if (xmidi_stats && xmidi_stats->field < (n)) xmidi_stats->field = (n); } while (0)
+
+/* Only reads the clock while collecting */
+#define STATS_NOW() (xmidi_stats ? stats_now_ns() : 0)
+
+uint64_t stats_now_ns(void);
+void print_stats_json(FILE* fp, struct XMIDI_stats* stats);
+#endif
@@ -1,13 +1,28 @@
 #include "xmidi_parser.h"
 #include "event.h"
+#include "hooks.h"
+#include "stats.h"
 
 #include <string.h>
 #include <stdio.h>
-#include <stdlib.h>
 
-#define warning(...) fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n");
+#define warning(...) xmidi_warning(__VA_ARGS__)
+#ifdef XMIDI_DEBUG
+#define debug(...) printf(__VA_ARGS__)
+#else
+#define debug(...) do { } while (0)
+#endif
 #define ARRAYSIZE(x) ((int)(sizeof(x) / sizeof(x[0])))
 
+static callback_trigger_proc callback_proc = NULL;
+static void* callback_data = NULL;
+
+void set_callback_trigger(callback_trigger_proc proc, void* data)
+{
+	callback_proc = proc;
+	callback_data = data;
+}
+
 static uint16_t read2low(uint8_t** data)
 {
 	uint8_t* d = *data;
@@ -19,7 +34,7 @@ static uint16_t read2low(uint8_t** data)
 static uint32_t read4high(uint8_t** data)
 {
 	uint8_t* d = *data;
-	uint16_t value = (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | (d[3]);
+	uint32_t value = ((uint32_t)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | (d[3]);
 	*data = (d + 4);
 	return value;
 }
@@ -70,23 +85,25 @@ static int putVLQ(uint8_t* dest, uint32_t value)
 	return i;
 }
 
-static int put_event(uint8_t* dest, struct EventInfo* info)
+/* Writes info to dest, or only sizes it if dest is NULL. last_event holds
+ * the running status, which each pass must start from 0 so that both agree
+ * and every track begins with a status byte. */
+static int put_event(uint8_t* dest, struct EventInfo* info, uint8_t* last_event)
 {
 	int i = 0,j;
 	int rc = 0;
-	static uint8_t last_event = 0;
 
 	rc = putVLQ (dest, info->delta);
 	if (dest) dest += rc;
 	i += rc;
 
-	if ((info->event != last_event) || (info->event >= 0xF0))
+	if ((info->event != *last_event) || (info->event >= 0xF0))
 	{
 		if (dest) *dest++ = (info->event);
 		i++;
 	}
 	
-	last_event = info->event;
+	*last_event = info->event;
 	
 	switch (info->event >> 4)
 	{
@@ -144,20 +161,41 @@ static int put_event(uint8_t* dest, struct EventInfo* info)
 	return i;
 }
 
-static int convert_to_mtrk(uint8_t* data, uint32_t size, uint8_t* dest)
+/* Gives info, happening at absolute tick t, its delta in an output that
+ * begins at tick start. Notes before start are left out, returning 0, and
+ * all other earlier events are squashed to the beginning so that the
+ * channel state is right when playback starts. */
+static int place_event(struct EventInfo* info, uint32_t t, uint32_t start, uint32_t* out_time)
+{
+	if (t < start) {
+		if ((info->event & 0xF0) == 0x80 || (info->event & 0xF0) == 0x90)
+			return 0;
+		info->delta = 0;
+		return ~0;
+	}
+
+	info->delta = t - *out_time;
+	*out_time = t;
+	return ~0;
+}
+
+static int convert_to_mtrk(uint8_t* data, struct XMIDI_info* xmidi_info, int track, uint32_t start, uint8_t* dest)
 {
 #if 1
-	int time = 0;
-	int lasttime = 0;
+	uint32_t time = 0;
+	uint32_t lasttime = 0;
 	int rc;
 //	XMidiEvent	*event;
 	uint32_t 	i = 8;
 	uint32_t 	j;
 	uint8_t*	size_pos = NULL;
-	uint8_t*	data_end = data + size;
-	struct XMIDI_info xmidi_info;
+	uint8_t*	data_end;
 	struct EventInfo info;
-	struct EventInfo* cached_info;
+	struct EventInfo cached_info;
+	uint32_t	out_time = start;
+	uint32_t	dropped = 0;
+	uint8_t		last_event = 0;
+	int		skip;
 
 	if (dest)
 	{
@@ -170,64 +208,77 @@ static int convert_to_mtrk(uint8_t* data, uint32_t size, uint8_t* dest)
 		dest += 4;
 	}
 
-	rc = read_XMIDI_header(data, size, &xmidi_info);
-	if (!rc) {
-		warning("Failed to read XMIDI header");
-		return 0;
-	}
+	data_end = data + xmidi_info->tracks[track].evnt.offset + xmidi_info->tracks[track].evnt.length;
+	data += xmidi_info->tracks[track].evnt.offset;
 
-	data = xmidi_info.tracks[0];
+	// Drop any Note Offs left over from the previous pass
+	clear_cached_events();
 
 	while (data < data_end)
 	{
-		printf("=======================================================================\n");
-		// We don't write the end of stream marker here, we'll do it later
-		if (data[0] == 0xFF && data[1] == 0x2f) {
-			printf("Got EOX\n");
-//			lasttime = event->time;
-			continue;
-		}
-
-		rc = read_event_info(data, &info, time);
+		debug("=======================================================================\n");
+		rc = read_event_info(data, &info, time, &skip);
 		if (!rc) {
 			warning("Failed to read event info %ld bytes from the end!", data_end - data);
 			return 0;
 		}
 		data += rc;
 
+		// Both passes decode everything, only count the one writing
+		if (dest)
+			STATS_ADD(events_decoded, 1);
+
 #if 1
-		cached_info = pop_cached_event(time, info.delta);
-		while (cached_info) {
-			printf("Injecting event %2X at time %2X\n", cached_info->event, time);
-			rc = put_event(dest, cached_info);
+		while (pop_cached_event(time, info.delta, &cached_info)) {
+			debug("Injecting event %2X at time %2X\n", cached_info.event, time);
+			time += cached_info.delta;
+			info.delta -= cached_info.delta;
+			if (!place_event(&cached_info, time, start, &out_time))
+				continue;
+
+			if (dest)
+				STATS_ADD(note_offs_injected, 1);
+			rc = put_event(dest, &cached_info, &last_event);
 			if (!rc) {
 				warning("Failed to save injected event!");
 				return 0;
 			}
 			if (dest) dest += rc;
 			i += rc;
-			time += cached_info->delta;
-			info.delta -= cached_info->delta;
-			free(cached_info);
-			cached_info = pop_cached_event(time, info.delta);
 		}
 #endif
 
-		printf("Saving event %02X\n", info.event);
-		rc = put_event(dest, &info);
-		if (!rc) {
-			warning("Failed to save event!");
-			return 0;
-		}
-		if (dest) dest += rc;
-		i += rc;
 		time += info.delta;
+		if (skip) {
+			dropped++;
+		}
+		else if (place_event(&info, time, start, &out_time)) {
+			debug("Saving event %02X\n", info.event);
+			rc = put_event(dest, &info, &last_event);
+			if (!rc) {
+				warning("Failed to save event!");
+				return 0;
+			}
+			if (dest) dest += rc;
+			i += rc;
+
+			// Only report triggers once, when actually writing the stream
+			if (dest && callback_proc && time >= start && (info.event & 0xF0) == 0xB0 && info.basic.param1 == 0x77)
+				callback_proc(info.basic.param2, time, callback_data);
+		}
+
 		if (info.event == 0xFF && info.ext.type == 0x2F) {
-			printf("GOT EOX\n");
+			debug("GOT EOX\n");
 			data = data_end;
 		}
 	}
 
+	// Both passes drop the same notes, only report the one writing
+	if (dest && dropped) {
+		warning("Left out %u notes, as %d were playing already", dropped, MAX_CACHED_EVENTS);
+		STATS_ADD(dropped_notes, dropped);
+	}
+
 	// Write out end of stream marker
 	if (lasttime > time) {
 		rc = putVLQ (dest, lasttime-time);
@@ -261,28 +312,50 @@ static int convert_to_mtrk(uint8_t* data, uint32_t size, uint8_t* dest)
 #endif
 }
 
-uint32_t convert_to_midi(uint8_t* data, uint32_t size, uint8_t** dest)
+/* Reads the chunk index used by both passes */
+static int read_index(uint8_t* data, uint32_t size, struct XMIDI_info* xmidi_info)
+{
+	uint64_t start_ns;
+	int rc;
+
+	STATS_ADD(bytes_in, size);
+
+	start_ns = STATS_NOW();
+	rc = read_XMIDI_header(data, size, xmidi_info);
+	STATS_ADD(read_header_ns, STATS_NOW() - start_ns);
+	if (!rc)
+		warning("Failed to read XMIDI header");
+	return rc;
+}
+
+/* Does a dry run. Returns the size of the MIDI file the given sequence
+ * converts to, or 0 on failure. */
+static uint32_t prepare_conversion(uint8_t* data, struct XMIDI_info* xmidi_info, int track, uint32_t start)
 {
 	int len;
-	uint8_t* d,* start;
+	uint64_t start_ns;
 
-	if (!dest)
+	if (track < 0 || track >= xmidi_info->num_tracks) {
+		warning("No track %d, there are only %d", track, (int)xmidi_info->num_tracks);
 		return 0;
+	}
 
-	/* Do a dry run first so we know how much memory to allocate */
-	len = convert_to_mtrk (data, size, NULL);
+	/* Do a dry run first so we know how much memory to use */
+	start_ns = STATS_NOW();
+	len = convert_to_mtrk (data, xmidi_info, track, start, NULL);
+	STATS_ADD(dry_run_ns, STATS_NOW() - start_ns);
 	if (!len) {
 		warning("Failed dummy conversion!");
 		return 0;
 	}
 
-	printf("Allocating %d bytes of memory\n", len);
-	d = malloc(len + 14);
-	if (!d) {
-		perror("Could not allocate memory");
-		return 0;
-	}
-	start = d;
+	return len + 14;
+}
+
+static uint32_t write_midi(uint8_t* data, struct XMIDI_info* xmidi_info, int track, uint32_t start, uint8_t* d)
+{
+	int len;
+	uint64_t start_ns;
 
 	*d++ = ('M');
 	*d++ = ('T');
@@ -293,35 +366,126 @@ uint32_t convert_to_midi(uint8_t* data, uint32_t size, uint8_t** dest)
 
 	write2high (&d, 0);
 	write2high (&d, 1);
-	write2high (&d, 60);	// The PPQN
+	write2high (&d, XMIDI_PPQN);
 
-	len = convert_to_mtrk(data, size, d);
+	start_ns = STATS_NOW();
+	len = convert_to_mtrk(data, xmidi_info, track, start, d);
+	STATS_ADD(convert_ns, STATS_NOW() - start_ns);
 	if (!len) {
 		warning("Failed to convert");
-		free(d);
 		return 0;
 	}
 
-	*dest = start;
-
+	STATS_ADD(bytes_out, len + 14);
 	return len + 14;
 }
 
+uint32_t convert_to_midi(uint8_t* data, uint32_t size, uint8_t** dest)
+{
+	return convert_to_midi_from(data, size, 0, dest);
+}
+
+uint32_t convert_to_midi_from(uint8_t* data, uint32_t size, uint32_t start, uint8_t** dest)
+{
+	uint32_t len;
+	struct XMIDI_info xmidi_info;
+
+	if (!dest)
+		return 0;
+
+	if (!read_index(data, size, &xmidi_info))
+		return 0;
+
+	len = convert_to_midi_info(data, &xmidi_info, 0, start, dest);
+	free_XMIDI_info(&xmidi_info);
+	return len;
+}
+
+uint32_t convert_to_midi_info(uint8_t* data, struct XMIDI_info* info, int track, uint32_t start, uint8_t** dest)
+{
+	uint32_t len;
+	uint8_t* d;
+
+	if (!dest)
+		return 0;
+
+	len = prepare_conversion(data, info, track, start);
+	if (!len)
+		return 0;
+
+	debug("Allocating %d bytes of memory\n", len);
+	d = xmidi_alloc(len);
+	if (!d) {
+		warning("Could not allocate %u bytes of memory", len);
+		return 0;
+	}
+
+	len = write_midi(data, info, track, start, d);
+	if (!len) {
+		xmidi_free(d);
+		return 0;
+	}
+
+	*dest = d;
+	return len;
+}
+
+uint32_t convert_to_midi_buffer(uint8_t* data, uint32_t size, uint8_t* dest, uint32_t dest_size)
+{
+	uint32_t len;
+	struct XMIDI_info xmidi_info;
+
+	if (!read_index(data, size, &xmidi_info))
+		return 0;
+
+	len = prepare_conversion(data, &xmidi_info, 0, 0);
+	if (len && dest && len <= dest_size)
+		len = write_midi(data, &xmidi_info, 0, 0, dest);
+
+	free_XMIDI_info(&xmidi_info);
+	return len;
+}
+
+uint64_t hash_XMIDI_track(uint8_t* data, struct XMIDI_info* info, int track)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint8_t* pos = data + info->tracks[track].evnt.offset;
+	uint8_t* end = pos + info->tracks[track].evnt.length;
+
+	while (pos < end) {
+		hash ^= *pos++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+void free_XMIDI_info(struct XMIDI_info* info)
+{
+	xmidi_free(info->tracks);
+	info->tracks = NULL;
+	info->num_tracks = 0;
+}
+
 /* Code adapted from the ScummVM project, which originally adapted it from the
  * Exult engine */
 int read_XMIDI_header(uint8_t* data, uint32_t size, struct XMIDI_info* info)
 {
 	uint32_t i = 0;
 	uint8_t *start;
+	uint8_t *end = data + size;
 	uint32_t len;
 	uint32_t chunkLen;
 	char buf[32];
+	struct XMIDI_chunk timb = { 0, 0 };
 
 //	_loopCount = -1;
 
 	uint8_t *pos = data;
 
-	if (!memcmp(pos, "FORM", 4)) {
+	info->num_tracks = 0;
+	info->tracks = NULL;
+
+	if (size >= 12 && !memcmp(pos, "FORM", 4)) {
 		pos += 4;
 
 		// Read length of
@@ -343,6 +507,11 @@ int read_XMIDI_header(uint8_t* data, uint32_t size, struct XMIDI_info* info)
 			info->num_tracks = 0;
 
 			for (i = 4; i < len; i++) {
+				if (end - pos < 8) {
+					warning("XDIR runs past the end of the data");
+					return 0;
+				}
+
 				// Read 4 bytes of type
 				memcpy(buf, pos, 4);
 				pos += 4;
@@ -355,13 +524,12 @@ int read_XMIDI_header(uint8_t* data, uint32_t size, struct XMIDI_info* info)
 
 				if (memcmp(buf, "INFO", 4) == 0) {
 					// Must be at least 2 bytes long
-					if (chunkLen < 2) {
+					if (chunkLen < 2 || end - pos < 2) {
 						warning("Invalid chunk length %d for 'INFO' block", (int)chunkLen);
 						return 0;
 					}
 
-					info->num_tracks = (uint8_t)read2low(&pos);
-					pos += 2;
+					info->num_tracks = read2low(&pos);
 
 					if (chunkLen > 2) {
 						warning("Chunk length %d is greater than 2", (int)chunkLen);
@@ -371,6 +539,10 @@ int read_XMIDI_header(uint8_t* data, uint32_t size, struct XMIDI_info* info)
 				}
 
 				// Must align
+				if ((uint64_t)((chunkLen + 1) & ~1) > (uint64_t)(end - pos)) {
+					warning("Chunk length %u runs past the end of the data", chunkLen);
+					return 0;
+				}
 				pos += (chunkLen + 1) & ~1;
 				i += (chunkLen + 1) & ~1;
 			}
@@ -383,6 +555,10 @@ int read_XMIDI_header(uint8_t* data, uint32_t size, struct XMIDI_info* info)
 
 			// Ok now to start part 2
 			// Goto the right place
+			if ((uint64_t)((len + 1) & ~1) + 12 > (uint64_t)(end - start)) {
+				warning("Missing 'CAT ' after XDIR");
+				return 0;
+			}
 			pos = start + ((len + 1) & ~1);
 
 			if (memcmp(pos, "CAT ", 4)) {
@@ -406,35 +582,57 @@ int read_XMIDI_header(uint8_t* data, uint32_t size, struct XMIDI_info* info)
 
 		// Ok it's an XMIDI.
 		// We're going to identify and store the location for each track.
-		if (info->num_tracks > ARRAYSIZE(info->tracks)) {
-			warning("Can only handle %d tracks but was handed %d", (int)ARRAYSIZE(info->tracks), (int)info->num_tracks);
+		info->tracks = xmidi_alloc(info->num_tracks * sizeof(struct XMIDI_sequence));
+		if (!info->tracks) {
+			warning("Could not allocate memory for %d tracks", (int)info->num_tracks);
+			info->num_tracks = 0;
 			return 0;
 		}
 
 		int tracksRead = 0;
 		while (tracksRead < info->num_tracks) {
+			if (end - pos < 8) {
+				warning("Only found %d of %d tracks", tracksRead, (int)info->num_tracks);
+				free_XMIDI_info(info);
+				return 0;
+			}
+
 			if (!memcmp(pos, "FORM", 4)) {
 				// Skip this plus the 4 bytes after it.
 				pos += 8;
 			} else if (!memcmp(pos, "XMID", 4)) {
 				// Skip this.
 				pos += 4;
-			} else if (!memcmp(pos, "TIMB", 4)) {
-				// Custom timbres?
-				// We don't support them.
-				// Read the length, skip it, and hope there was nothing there.
-				pos += 4;
-				len = read4high(&pos);
-				pos += (len + 1) & ~1;
-			} else if (!memcmp(pos, "EVNT", 4)) {
-				// Ahh! What we're looking for at last.
-				info->tracks[tracksRead] = pos + 8; // Skip the EVNT and length bytes
+			} else if (!memcmp(pos, "TIMB", 4) || !memcmp(pos, "EVNT", 4)) {
+				memcpy(buf, pos, 4);
 				pos += 4;
 				len = read4high(&pos);
-				pos += (len + 1) & ~1;
-				++tracksRead;
+				if ((uint64_t)len > (uint64_t)(end - pos)) {
+					warning("Chunk length %u runs past the end of the data", len);
+					free_XMIDI_info(info);
+					return 0;
+				}
+
+				if (!memcmp(buf, "TIMB", 4)) {
+					// Custom timbres, belonging to the following EVNT
+					timb.offset = pos - data;
+					timb.length = len;
+				} else {
+					// Ahh! What we're looking for at last.
+					info->tracks[tracksRead].evnt.offset = pos - data;
+					info->tracks[tracksRead].evnt.length = len;
+					info->tracks[tracksRead].timb = timb;
+					timb.offset = timb.length = 0;
+					++tracksRead;
+				}
+
+				// Must align, but the pad byte may be missing at the very end
+				pos += len;
+				if ((len & 1) && pos < end)
+					pos++;
 			} else {
 				warning("Hit invalid block '%c%c%c%c' while scanning for track locations", pos[0], pos[1], pos[2], pos[3]);
+				free_XMIDI_info(info);
 				return 0;
 			}
 		}
@@ -453,3 +651,78 @@ int read_XMIDI_header(uint8_t* data, uint32_t size, struct XMIDI_info* info)
 
 	return 0;
 }
+
+int collect_XMIDI_patches(uint8_t* data, struct XMIDI_info* info, int track,
+                          struct XMIDI_patch** patches)
+{
+	uint8_t used[256][128 / 8];
+	uint8_t bank[16];
+	uint8_t* pos,* end;
+	struct EventInfo event;
+	struct XMIDI_patch* list;
+	uint16_t count;
+	int i, j, n, rc;
+
+	if (track < 0 || track >= info->num_tracks) {
+		warning("No track %d, there are only %d", track, (int)info->num_tracks);
+		return -1;
+	}
+
+	memset(used, 0, sizeof(used));
+	memset(bank, 0, sizeof(bank));
+
+	/* TIMB is a count followed by that many patch, bank pairs */
+	if (info->tracks[track].timb.length >= 2) {
+		pos = data + info->tracks[track].timb.offset;
+		count = read2low(&pos);
+		if (count > (info->tracks[track].timb.length - 2) / 2) {
+			warning("TIMB claims %d entries but only has room for %d",
+				(int)count, (int)(info->tracks[track].timb.length - 2) / 2);
+			count = (info->tracks[track].timb.length - 2) / 2;
+		}
+		for (i = 0; i < count; i++, pos += 2)
+			used[pos[1]][(pos[0] & 0x7F) / 8] |= 1 << (pos[0] & 7);
+	}
+
+	/* Program changes pick from the bank last selected on their channel */
+	pos = data + info->tracks[track].evnt.offset;
+	end = pos + info->tracks[track].evnt.length;
+	while (pos < end) {
+		rc = decode_event(pos, &event);
+		if (!rc)
+			break;
+		pos += rc;
+
+		if ((event.event & 0xF0) == 0xB0 && event.basic.param1 == 0x72) // XMIDI_CONTROLLER_BANK_CHANGE
+			bank[event.event & 0x0F] = event.basic.param2;
+		else if ((event.event & 0xF0) == 0xC0)
+			used[bank[event.event & 0x0F]][(event.basic.param1 & 0x7F) / 8] |= 1 << (event.basic.param1 & 7);
+		else if (event.event == 0xFF && event.ext.type == 0x2F)
+			break;
+	}
+
+	n = 0;
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < 128; j++)
+			n += (used[i][j / 8] >> (j & 7)) & 1;
+
+	list = xmidi_alloc((n ? n : 1) * sizeof(struct XMIDI_patch));
+	if (!list) {
+		warning("Could not allocate memory for %d patches", n);
+		return -1;
+	}
+
+	n = 0;
+	for (i = 0; i < 256; i++) {
+		for (j = 0; j < 128; j++) {
+			if ((used[i][j / 8] >> (j & 7)) & 1) {
+				list[n].patch = j;
+				list[n].bank = i;
+				n++;
+			}
+		}
+	}
+
+	*patches = list;
+	return n;
+}
@@ -1,9 +1,77 @@
+#ifndef XMIDI_PARSER_H
+#define XMIDI_PARSER_H
 #include <inttypes.h>
 
+#define XMIDI_PPQN 60
+#define XMIDI_TEMPO 500000 // Microseconds per quarter note
+
+struct XMIDI_chunk {
+	uint32_t offset; // Of the chunk data, from the start of the file
+	uint32_t length; // Excluding the chunk header and pad byte
+};
+
+struct XMIDI_sequence {
+	struct XMIDI_chunk evnt;
+	struct XMIDI_chunk timb; // Zero length if there is no TIMB chunk
+};
+
+struct XMIDI_patch {
+	uint8_t patch;
+	uint8_t bank;
+};
+
 struct XMIDI_info {
-	uint8_t num_tracks;
-	uint8_t* tracks[120]; // Maximum 120 tracks
+	uint16_t num_tracks;
+	struct XMIDI_sequence* tracks; // num_tracks entries
 };
 
+/* Called once for every XMIDI callback trigger (controller 0x77) written to
+ * the converted stream. time is the absolute tick of the trigger. */
+typedef void (*callback_trigger_proc)(uint8_t value, uint32_t time, void* data);
+
+void set_callback_trigger(callback_trigger_proc proc, void* data);
+
+/* Converts the first sequence to a Standard MIDI File in memory from
+ * xmidi_alloc(), which must be released with xmidi_free(). Returns the
+ * size of the MIDI file, or 0 on failure.
+ *
+ * At most MAX_CACHED_EVENTS (from event.h) notes can play at once. Any
+ * Note On beyond that is left out with a warning, like the sequencer
+ * does, rather than failing the conversion. The same holds for all the
+ * other convert_to_midi*() functions. */
 uint32_t convert_to_midi(uint8_t* data, uint32_t size, uint8_t** dest);
+
+/* Like convert_to_midi(), but the MIDI file starts at the given tick of
+ * the sequence. Notes before it are left out, while all other earlier
+ * events are moved to the very start, so that the channels are set up as
+ * they would be at that point. */
+uint32_t convert_to_midi_from(uint8_t* data, uint32_t size, uint32_t start, uint8_t** dest);
+
+/* Like convert_to_midi_from(), but converts the given track using an
+ * index from read_XMIDI_header(), so that callers converting or inspecting
+ * a file several times only read its header once. */
+uint32_t convert_to_midi_info(uint8_t* data, struct XMIDI_info* info, int track, uint32_t start,
+                              uint8_t** dest);
+
+/* Like convert_to_midi(), but writes into dest. Returns the size of the
+ * MIDI file, which was only written if it fits in dest_size bytes, or 0
+ * on failure. Only the chunk index is allocated, so with an arena from
+ * use_XMIDI_arena() the heap is never touched. */
+uint32_t convert_to_midi_buffer(uint8_t* data, uint32_t size, uint8_t* dest, uint32_t dest_size);
+
+/* Indexes the sequences in an XMIDI file. On success, the index must be
+ * released with free_XMIDI_info(). */
 int read_XMIDI_header(uint8_t* data, uint32_t size, struct XMIDI_info* info);
+void free_XMIDI_info(struct XMIDI_info* info);
+
+/* Hashes the EVNT chunk of a sequence, e.g. to tell which ones changed.
+ * Note that conversion modifies tempo events, so hash before converting. */
+uint64_t hash_XMIDI_track(uint8_t* data, struct XMIDI_info* info, int track);
+
+/* Collects the instruments a sequence needs, from its TIMB chunk and from
+ * the program changes (with XMIDI bank changes) in its events. Returns the
+ * number of distinct pairs stored in *patches, sorted by bank and patch,
+ * or -1 on failure. *patches must be released with xmidi_free(). */
+int collect_XMIDI_patches(uint8_t* data, struct XMIDI_info* info, int track,
+                          struct XMIDI_patch** patches);
+#endif
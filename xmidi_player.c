@@ -1,13 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 
 #include <SDL/SDL.h>
 #include <SDL/SDL_mixer.h>
 
 #include <semaphore.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 
 #include "xmidi_parser.h"
+#include "callback_queue.h"
+#include "stats.h"
+#include "scanner.h"
+#include "hooks.h"
 
 static uint32_t get_file_size(FILE* fp)
 {
@@ -21,6 +29,91 @@ static uint32_t get_file_size(FILE* fp)
 	return size;
 }
 
+static uint8_t* read_file(const char* filename, uint32_t* size)
+{
+	FILE* fp;
+	uint8_t* data;
+	size_t bytes_read;
+
+	fp = fopen(filename, "rb");
+	if (!fp) {
+		perror("Failed to open file");
+		return NULL;
+	}
+
+	*size = get_file_size(fp);
+	if (!*size) {
+		printf("Failed to get size of file\n");
+		fclose(fp);
+		return NULL;
+	}
+
+	data = malloc(*size);
+	STATS_ADD(allocations, 1);
+	if (!data) {
+		perror("Failed to allocate memory");
+		fclose(fp);
+		return NULL;
+	}
+
+	bytes_read = fread(data, 1, *size, fp);
+	fclose(fp);
+	if (bytes_read != *size) {
+		perror("Failed to read all data");
+		free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+/* Maps the archive and finds the XMIDI files in it, using the index next
+ * to it unless it is stale or a rescan is forced. Returns the number of
+ * entries, or -1 on failure. */
+static int load_archive(const char* filename, int rescan, uint8_t** map,
+                        size_t* map_size, struct ArchiveEntry** entries)
+{
+	char index_path[4096];
+	int count = -1;
+
+	*map = map_archive(filename, map_size);
+	if (!*map)
+		return -1;
+
+	snprintf(index_path, sizeof(index_path), "%s.idx", filename);
+	if (!rescan)
+		count = read_archive_index(index_path, filename, entries);
+
+	if (count < 0) {
+		printf("Scanning %s for XMIDI files\n", filename);
+		count = scan_archive(*map, *map_size, entries);
+		if (count >= 0)
+			write_archive_index(index_path, filename, *entries, count);
+	}
+
+	if (count < 0) {
+		unmap_archive(*map, *map_size);
+		*map = NULL;
+	}
+	return count;
+}
+
+static void print_patches(uint8_t* data, struct XMIDI_info* info)
+{
+	struct XMIDI_patch* patches;
+	int count, i;
+
+	count = collect_XMIDI_patches(data, info, 0, &patches);
+	if (count < 0)
+		return;
+
+	printf("Instruments used (bank:patch):");
+	for (i = 0; i < count; i++)
+		printf(" %d:%d", patches[i].bank, patches[i].patch);
+	printf("\n");
+	xmidi_free(patches);
+}
+
 void init_SDL()
 {
 	/* We're going to be requesting certain things from our audio
@@ -40,76 +133,504 @@ void init_SDL()
 	}
 }
 
+/* Callback triggers found while converting, in playback order */
+static struct CallbackTrigger* triggers = NULL;
+static int num_triggers = 0;
+static uint32_t trigger_start = 0; // Tick at which the playing music starts
+
+static void record_trigger(uint8_t value, uint32_t time, void* data)
+{
+	struct CallbackTrigger* temp;
+
+	temp = realloc(triggers, (num_triggers + 1) * sizeof(struct CallbackTrigger));
+	if (!temp) {
+		printf("Dropping callback trigger %d, out of memory\n", value);
+		return;
+	}
+	triggers = temp;
+	triggers[num_triggers].time = time;
+	triggers[num_triggers].value = value;
+	triggers[num_triggers].due_ms = (uint64_t)(time - trigger_start) * XMIDI_TEMPO / XMIDI_PPQN / 1000;
+	triggers[num_triggers].posted_ms = 0;
+	num_triggers++;
+}
+
+/* Shared between the audio thread (producer) and main thread (consumer) */
+static struct CallbackQueue trigger_queue;
+static int next_trigger = 0;
+static uint64_t samples_mixed = 0;
+static int mix_rate, mix_channels, frame_size;
+
+/* The audio clock, as of the last mixed buffer. clock_seq is odd while the
+ * audio thread updates the rest, so that they are read consistently. */
+static atomic_uint clock_seq;
+static atomic_uint_fast64_t clock_samples; // Audio handed to the device
+static atomic_uint_fast64_t clock_end;     // Audio mixed, including the latest buffer
+static atomic_uint_fast64_t clock_ns;      // When clock_samples was reached
+
+static void publish_clock(uint64_t samples, uint64_t end)
+{
+	atomic_fetch_add(&clock_seq, 1);
+	atomic_store(&clock_samples, samples);
+	atomic_store(&clock_end, end);
+	atomic_store(&clock_ns, stats_now_ns());
+	atomic_fetch_add(&clock_seq, 1);
+}
+
+/* Runs on the audio thread after every mixed buffer. Queues the triggers
+ * that fall within the audio mixed so far and never waits for anything. */
+static void post_mix(void* udata, Uint8* stream, int len)
+{
+	uint32_t mixed_ms;
+
+	/* The audio before this buffer has gone to the device by now, while
+	 * this one only plays once that is done */
+	publish_clock(samples_mixed, samples_mixed + len / frame_size);
+	samples_mixed += len / frame_size;
+	mixed_ms = samples_mixed * 1000 / mix_rate;
+
+	while (next_trigger < num_triggers && triggers[next_trigger].due_ms <= mixed_ms) {
+		triggers[next_trigger].posted_ms = mixed_ms;
+		if (!callback_queue_push(&trigger_queue, &triggers[next_trigger]))
+			break; // Full, try again with the next buffer
+		next_trigger++;
+	}
+}
+
+/* Hands due triggers over to the application and keeps track of how late
+ * they were delivered, relative to the audio played rather than the wall
+ * clock, so that buffering doesn't count as being on time. */
+static struct CallbackTrigger pending_trigger;
+static int have_pending_trigger = 0;
+static int triggers_delivered = 0;
+static uint32_t max_jitter_ms = 0;
+static uint64_t total_jitter_ms = 0;
+
+/* The playback position, interpolated from the last mixed buffer by the
+ * time passed since, as the audio clock itself only moves once per buffer */
+static uint32_t played_ms(void)
+{
+	uint64_t samples, end, ns, elapsed;
+	unsigned int seq;
+
+	do {
+		seq = atomic_load(&clock_seq);
+		samples = atomic_load(&clock_samples);
+		end = atomic_load(&clock_end);
+		ns = atomic_load(&clock_ns);
+	} while ((seq & 1) || seq != atomic_load(&clock_seq));
+
+	/* Never run ahead of the mixed audio, e.g. if the audio thread stalls */
+	elapsed = stats_now_ns() - ns;
+	if (elapsed > (end - samples) * 1000000000 / mix_rate)
+		elapsed = (end - samples) * 1000000000 / mix_rate;
+	return (samples * 1000000000 / mix_rate + elapsed) / 1000000;
+}
+
+static void dispatch_triggers(void)
+{
+	uint32_t now_ms, jitter;
+
+	for (;;) {
+		if (!have_pending_trigger)
+			have_pending_trigger = callback_queue_pop(&trigger_queue, &pending_trigger);
+		if (!have_pending_trigger)
+			return;
+
+		now_ms = played_ms();
+		if (now_ms < pending_trigger.due_ms)
+			return;
+
+		jitter = now_ms - pending_trigger.due_ms;
+		if (jitter > max_jitter_ms)
+			max_jitter_ms = jitter;
+		total_jitter_ms += jitter;
+		triggers_delivered++;
+		have_pending_trigger = 0;
+
+		printf("Callback trigger %d at tick %u, %u ms (jitter %u ms)\n",
+			pending_trigger.value, pending_trigger.time, now_ms, jitter);
+	}
+}
+
 sem_t stop_semaphore;
+static int keep_running = 0;         // --watch: wait for changes once the music ends
+static atomic_int music_finished = 0; // 1 once the music ends, 2 once that is reported
+
 void musicDone()
+{
+	if (keep_running)
+		atomic_store(&music_finished, 1);
+	else
+		sem_post(&stop_semaphore);
+}
+
+/* Ends --watch, which otherwise runs until interrupted */
+static void stop_playing(int sig)
 {
 	sem_post(&stop_semaphore);
 }
 
+/* For --watch. The directory is watched rather than the file itself, as
+ * many editors save by replacing the file. */
+static int watch_fd = -1;
+static const char* watch_name;
+static uint64_t* track_hashes = NULL;
+static int num_track_hashes = 0;
+
+static int watch_file(const char* filename)
+{
+	char dir[4096];
+	const char* slash = strrchr(filename, '/');
+
+	if (slash) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - filename), filename);
+		if (!dir[0])
+			strcpy(dir, "/");
+		watch_name = slash + 1;
+	}
+	else {
+		strcpy(dir, ".");
+		watch_name = filename;
+	}
+
+	watch_fd = inotify_init1(IN_NONBLOCK);
+	if (watch_fd < 0) {
+		perror("Failed to set up inotify");
+		return 0;
+	}
+
+	if (inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror("Failed to watch directory");
+		close(watch_fd);
+		watch_fd = -1;
+		return 0;
+	}
+	return ~0;
+}
+
+/* Returns non-zero if the watched file was written since the last call */
+static int file_changed(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event* event;
+	ssize_t len;
+	char* p;
+	int changed = 0;
+
+	while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event*)p;
+			if (event->len && !strcmp(event->name, watch_name))
+				changed = 1;
+		}
+	}
+	return changed;
+}
+
+/* Hashes every sequence in data and reports the ones that changed since
+ * the last call. Returns 1 if the played sequence changed, 0 if it didn't
+ * and -1 on failure. Must be called before converting, as
+ * that modifies the data. */
+static int update_hashes(uint8_t* data, struct XMIDI_info* info)
+{
+	uint64_t* hashes;
+	int i, changed = 0;
+
+	hashes = malloc(info->num_tracks * sizeof(uint64_t));
+	if (!hashes) {
+		perror("Failed to allocate memory");
+		return -1;
+	}
+
+	for (i = 0; i < info->num_tracks; i++) {
+		hashes[i] = hash_XMIDI_track(data, info, i);
+		if (i < num_track_hashes && hashes[i] == track_hashes[i])
+			continue;
+
+		if (track_hashes)
+			printf("Sequence %d changed\n", i);
+		if (i == 0)
+			changed = 1;
+	}
+
+	free(track_hashes);
+	track_hashes = hashes;
+	num_track_hashes = info->num_tracks;
+	return changed;
+}
+
+/* Reads filename again and, if the played sequence changed, converts it
+ * from the current playback position on and swaps it in. */
+static void reload_song(const char* filename, uint8_t** data, uint8_t** out_data,
+                        SDL_RWops** rw, Mix_Music** music)
+{
+	struct CallbackTrigger* old_triggers;
+	int old_num_triggers;
+	uint32_t old_trigger_start;
+	struct XMIDI_info info;
+	uint8_t* new_data,* new_out;
+	SDL_RWops* new_rw;
+	Mix_Music* new_music;
+	uint32_t size, out_size, position;
+	uint64_t start_ns = stats_now_ns();
+
+	new_data = read_file(filename, &size);
+	if (!new_data)
+		return;
+
+	if (!read_XMIDI_header(new_data, size, &info)) {
+		free(new_data);
+		return;
+	}
+
+	if (update_hashes(new_data, &info) <= 0) {
+		free_XMIDI_info(&info);
+		free(new_data);
+		return;
+	}
+
+	/* Once the music has ended, play the new version from the start */
+	if (atomic_load(&music_finished))
+		position = 0;
+	else
+		position = trigger_start + (uint64_t)played_ms() * 1000 * XMIDI_PPQN / XMIDI_TEMPO;
+
+	/* Keep the audio thread away from the triggers while they are
+	 * collected again, and hold on to the old ones in case it fails */
+	Mix_SetPostMix(NULL, NULL);
+	old_triggers = triggers;
+	old_num_triggers = num_triggers;
+	old_trigger_start = trigger_start;
+	triggers = NULL;
+	num_triggers = 0;
+	trigger_start = position;
+
+	out_size = convert_to_midi_info(new_data, &info, 0, position, &new_out);
+	free_XMIDI_info(&info);
+	if (!out_size) {
+		printf("Failed to convert %s, keeping the old version\n", filename);
+		goto err_restore;
+	}
+
+	/* Load the new version while the old one keeps playing */
+	new_rw = SDL_RWFromMem(new_out, out_size);
+	new_music = Mix_LoadMUS_RW(new_rw);
+	if (!new_music) {
+		printf("Failed to load %s, keeping the old version: %s\n", filename, Mix_GetError());
+		SDL_FreeRW(new_rw);
+		xmidi_free(new_out);
+		goto err_restore;
+	}
+
+	free(old_triggers);
+	next_trigger = 0;
+	samples_mixed = 0;
+	publish_clock(0, 0);
+	have_pending_trigger = 0;
+	while (callback_queue_pop(&trigger_queue, &pending_trigger))
+		;
+
+	/* Halting would otherwise count as the music having finished */
+	Mix_HookMusicFinished(NULL);
+	Mix_HaltMusic();
+	Mix_FreeMusic(*music);
+	SDL_FreeRW(*rw);
+	xmidi_free(*out_data);
+	free(*data);
+
+	*data = new_data;
+	*out_data = new_out;
+	*rw = new_rw;
+	*music = new_music;
+	Mix_SetPostMix(post_mix, NULL);
+	atomic_store(&music_finished, 0);
+	Mix_HookMusicFinished(musicDone);
+	Mix_PlayMusic(*music, 0);
+
+	printf("Reloaded %s at tick %u in %" PRIu64 " us\n", filename, position,
+		(stats_now_ns() - start_ns) / 1000);
+	return;
+
+err_restore:
+	free(triggers);
+	triggers = old_triggers;
+	num_triggers = old_num_triggers;
+	trigger_start = old_trigger_start;
+	Mix_SetPostMix(post_mix, NULL);
+	free(new_data);
+}
+
 int main(int argc, char* argv[]) {
-	FILE* fp,* out_fp;
 	uint32_t size;
-	int rc;
 	uint8_t* data,* out_data;
-	size_t bytes_read;
+	uint8_t* map = NULL;
 	struct XMIDI_info info;
+	size_t map_size;
+	struct ArchiveEntry* entries;
 	SDL_RWops *rw;
 	Mix_Music* music;
-	
-	if (argc < 2) {
-		printf("%s <xmi file>\n", argv[0]);
-		return EXIT_FAILURE;
-	}
+	Uint16 mix_format;
+	char* filename = NULL;
+	struct XMIDI_stats stats;
+	uint64_t start_ns;
+	int i, count, rc;
+	int song = -1;
+	int scan = 0;
+	int list_patches = 0;
+	int watch = 0;
 
-	fp = fopen(argv[1], "rb");
-	if (!fp) {
-		perror("Failed to open file");
-		return EXIT_FAILURE;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--stats")) {
+			memset(&stats, 0, sizeof(stats));
+			xmidi_stats = &stats;
+		}
+		else if (!strcmp(argv[i], "--patches")) {
+			list_patches = 1;
+		}
+		else if (!strcmp(argv[i], "--watch")) {
+			watch = 1;
+		}
+		else if (!strcmp(argv[i], "--scan")) {
+			scan = 1;
+		}
+		else if (!strcmp(argv[i], "--song") && i + 1 < argc) {
+			song = atoi(argv[++i]);
+		}
+		else {
+			filename = argv[i];
+		}
 	}
 
-	size = get_file_size(fp);
-	if (!size) {
-		printf("Failed to get size of file\n");
+	if (!filename || (watch && (scan || song >= 0))) {
+		printf("%s [--stats] [--patches] [--watch] <xmi file>\n", argv[0]);
+		printf("%s --scan <archive>\n", argv[0]);
+		printf("%s [--stats] [--patches] --song <n> <archive>\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	data = malloc(size);
-	if (!data) {
-		perror("Failed to allocate memory");
-		fclose(fp);
-		return EXIT_FAILURE;
+	start_ns = STATS_NOW();
+	if (scan || song >= 0) {
+		count = load_archive(filename, scan, &map, &map_size, &entries);
+		if (count < 0)
+			return EXIT_FAILURE;
+
+		if (scan) {
+			for (i = 0; i < count; i++) {
+				printf("%d: offset %" PRIu64 ", %" PRIu32 " bytes, %d sequences\n",
+					i, entries[i].offset, entries[i].size, (int)entries[i].num_tracks);
+			}
+			xmidi_free(entries);
+			unmap_archive(map, map_size);
+			return EXIT_SUCCESS;
+		}
+
+		if (song >= count) {
+			printf("There is no song %d, only %d found\n", song, count);
+			xmidi_free(entries);
+			unmap_archive(map, map_size);
+			return EXIT_FAILURE;
+		}
+
+		data = map + entries[song].offset;
+		size = entries[song].size;
+		xmidi_free(entries);
+	}
+	else {
+		data = read_file(filename, &size);
+		if (!data)
+			return EXIT_FAILURE;
 	}
+	STATS_ADD(read_file_ns, STATS_NOW() - start_ns);
 
-	bytes_read = fread(data, 1, size, fp);
-	if (bytes_read != size) {
-		perror("Failed to read all data");
+	/* Read the chunk index once, for everything below */
+	STATS_ADD(bytes_in, size);
+	start_ns = STATS_NOW();
+	rc = read_XMIDI_header(data, size, &info);
+	STATS_ADD(read_header_ns, STATS_NOW() - start_ns);
+	if (!rc) {
+		printf("%s is not a valid XMIDI file\n", filename);
 		goto err_free;
 	}
 
-	size = convert_to_midi(data, size, &out_data);
+	if (list_patches)
+		print_patches(data, &info);
+
+	if (watch) {
+		if (!watch_file(filename) || update_hashes(data, &info) < 0)
+			goto err_free_info;
+	}
+
+	set_callback_trigger(record_trigger, NULL);
+	size = convert_to_midi_info(data, &info, 0, 0, &out_data);
+	free_XMIDI_info(&info);
 	if (!size)
 		goto err_free;
 
 	sem_init(&stop_semaphore, 0, 0);
 	init_SDL();
 	rw = SDL_RWFromMem(out_data, size);
+	start_ns = STATS_NOW();
 	music = Mix_LoadMUS_RW(rw);
-	Mix_PlayMusic(music, 0);
+	STATS_ADD(load_music_ns, STATS_NOW() - start_ns);
+	if (!music) {
+		printf("Unable to load music: %s\n", Mix_GetError());
+		exit(1);
+	}
+	if (xmidi_stats)
+		print_stats_json(stdout, xmidi_stats);
+
+	Mix_QuerySpec(&mix_rate, &mix_format, &mix_channels);
+	frame_size = (mix_format & 0xFF) / 8 * mix_channels; // Low byte is the sample size in bits
+	callback_queue_init(&trigger_queue);
+	Mix_SetPostMix(post_mix, NULL);
+	if (watch) {
+		keep_running = 1;
+		signal(SIGINT, stop_playing);
+		signal(SIGTERM, stop_playing);
+	}
 	Mix_HookMusicFinished(musicDone);
+	Mix_PlayMusic(music, 0);
 
-	sem_wait(&stop_semaphore);
+	while (sem_trywait(&stop_semaphore)) {
+		dispatch_triggers();
+		if (atomic_load(&music_finished) == 1) {
+			atomic_store(&music_finished, 2);
+			printf("Finished, waiting for %s to change (Ctrl-C quits)\n", filename);
+		}
+		if (watch_fd >= 0 && file_changed())
+			reload_song(filename, &data, &out_data, &rw, &music);
+		SDL_Delay(1);
+	}
+	Mix_SetPostMix(NULL, NULL);
+
+	if (triggers_delivered) {
+		printf("Delivered %d callback triggers, jitter max %u ms, mean %u ms\n",
+			triggers_delivered, max_jitter_ms,
+			(uint32_t)(total_jitter_ms / triggers_delivered));
+	}
 
 	/* This is the cleaning up part */
 	Mix_CloseAudio();
 	SDL_Quit();
-	free(data);
-	free(out_data);
-	fclose(fp);
+	xmidi_free(out_data);
+	free(triggers);
+	free(track_hashes);
+	if (watch_fd >= 0)
+		close(watch_fd);
+	if (map)
+		unmap_archive(map, map_size);
+	else
+		free(data);
 	return EXIT_SUCCESS;
 
+err_free_info:
+	free_XMIDI_info(&info);
 err_free:
-	free(data);
-	fclose(fp);
+	if (map)
+		unmap_archive(map, map_size);
+	else
+		free(data);
 	return EXIT_FAILURE;
 }
 